@@ -0,0 +1,61 @@
+#ifndef NOREBO_PLUGIN_H
+#define NOREBO_PLUGIN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "risc-cpu.h"
+
+// Norebo loads every *.so file in the directory named by NOREBO_PLUGINS
+// and calls its norebo_plugin_init function. Plugins register native
+// handlers under a name; Oberon code finds them with Norebo.Lookup and
+// calls them with Norebo.SysReq like any built-in sysreq.
+//
+// Plugins can also supply native code for Oberon modules; see
+// translate-rsc.py.
+
+#define NOREBO_PLUGIN_ABI 2
+
+typedef uint32_t (*norebo_sysreq_fn)(uint32_t arg1, uint32_t arg2, uint32_t arg3);
+
+struct norebo_host;
+
+// Runs the module's code starting at risc->PC, until control leaves the
+// code, which starts at word address org.
+typedef void (*norebo_native_fn)(const struct norebo_host *host,
+                                 const struct RISC_IO *io,
+                                 struct RISC *risc, uint32_t org);
+
+struct norebo_native {
+  const char *name;
+  uint32_t key;
+  uint32_t nwords;
+  const uint32_t *code;   // program code as in the .rsc file
+  const uint8_t *fixed;   // nonzero for words the loader fixes up
+  norebo_native_fn run;
+};
+
+struct norebo_host {
+  uint32_t abi;
+
+  // Returns a pointer to siz bytes of guest memory at adr. Norebo exits
+  // with an error message naming proc if the range is out of bounds.
+  uint8_t *(*mem)(uint32_t adr, uint32_t siz, const char *proc);
+
+  // Registers fn under name (letters, digits and dots, at most 31
+  // characters). Returns the sysreq number, or 0 if the name is invalid,
+  // already taken, or no sysreq numbers are left.
+  uint32_t (*register_sysreq)(const char *name, norebo_sysreq_fn fn);
+
+  // Since ABI 2. Registers native code for a module. Once the module is
+  // loaded with the same key and code, branches into its code run the
+  // native version. Returns false if the table is full.
+  bool (*register_native)(const struct norebo_native *native);
+
+  // Since ABI 2. Executes one instruction in the interpreter.
+  void (*execute)(const struct RISC_IO *io, struct RISC *risc, uint32_t ir);
+};
+
+// Returns 0 on success.
+int norebo_plugin_init(const struct norebo_host *host);
+
+#endif  // NOREBO_PLUGIN_H
@@ -1,5 +1,4 @@
 #define _GNU_SOURCE
-#include <assert.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -11,22 +10,41 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <dlfcn.h>
 #include "risc-cpu.h"
+#include "norebo-plugin.h"
 
 #define PathEnv "NOREBO_PATH"
+#define PluginEnv "NOREBO_PLUGINS"
+#define GCEnv "NOREBO_GC"
 #define InnerCore "InnerCore"
 
 #define MemBytes (8 * 1024 * 1024)
 #define StackOrg 0x80000
 #define MaxFiles 500
 #define NameLength 32
+#define FileBufSize 4096
+#define MaxScriptArgs 256
+#define PluginBase 100
+#define MaxPlugins 100
+#define MaxNatives 256
 
 struct File {
-  FILE *f;
+  int fd;  // -1 when the slot is free
   char name[NameLength];
-  bool registered;
+  bool registered, writable;
+  uint32_t pos, len;
+  bool date_valid;
+  uint32_t date;
+  dev_t dev;  // identity of the host file, for registered files
+  ino_t ino;
+  bool shared;  // another handle is open on the same host file
+  // One block of the file, at buf_pos; bytes [dirty_lo, dirty_hi) are not yet written
+  uint8_t *buf;
+  uint32_t buf_pos, buf_len, dirty_lo, dirty_hi;
 };
 
 static uint8_t mem[MemBytes];
@@ -34,7 +52,34 @@ static uint32_t sysarg[3], sysres;
 static uint32_t nargc;
 static char **nargv;
 static struct File files[MaxFiles];
-static DIR *dir;
+
+struct DirEntry {
+  char name[NameLength];
+  uint32_t size, date, order;
+};
+
+static struct DirEntry *dir_entries;
+static uint32_t dir_count, dir_cap, dir_next;
+
+struct Script {
+  FILE *f;
+  const char *name;
+  bool collect, free;
+  uint32_t step;
+  char *line;
+  size_t line_cap;
+  char *argv[MaxScriptArgs];
+  struct timespec start;
+};
+
+static struct Script script;
+
+struct Perf {
+  uint64_t loads, stores, sysreqs, bytes;
+};
+
+static struct RISC cpu;
+static struct Perf perf;
 
 /* Memory access */
 
@@ -103,6 +148,98 @@ static uint32_t norebo_argv(uint32_t idx, uint32_t adr, uint32_t siz) {
   }
 }
 
+static bool script_next_command(void) {
+  while (getline(&script.line, &script.line_cap, script.f) >= 0) {
+    uint32_t n = 0;
+    for (char *tok = strtok(script.line, " \t\r\n"); tok; tok = strtok(NULL, " \t\r\n")) {
+      if (n == 0 && tok[0] == '#') {
+        break;
+      }
+      if (n == MaxScriptArgs) {
+        errx(1, "%s: Too many arguments", script.name);
+      }
+      script.argv[n++] = tok;
+    }
+    if (n > 0) {
+      nargc = n;
+      nargv = script.argv;
+      script.step++;
+      clock_gettime(CLOCK_MONOTONIC, &script.start);
+      return true;
+    }
+  }
+  if (ferror(script.f)) {
+    err(1, "%s", script.name);
+  }
+  return false;
+}
+
+static int files_count_open(void);
+
+static uint32_t norebo_next(uint32_t res, uint32_t _2, uint32_t _3) {
+  if (!script.f) {
+    return 0;
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double elapsed = (double)(now.tv_sec - script.start.tv_sec) +
+    (double)(now.tv_nsec - script.start.tv_nsec) / 1e9;
+  fflush(stdout);
+  fprintf(stderr, "norebo: [%u] %s: res %d, %.3f s\n", script.step, nargv[0], (int)res, elapsed);
+  if (res != 0 || !script_next_command()) {
+    return 0;
+  }
+  // Collect anyway once many files are open, so that the files the
+  // previous steps left open are closed before the handles run out.
+  bool collect = script.collect || files_count_open() >= MaxFiles / 2;
+  return 1 | (collect ? 2 : 0) | (script.free ? 4 : 0);
+}
+
+// The garbage collection between steps is not part of the next command
+static uint32_t norebo_start(uint32_t _1, uint32_t _2, uint32_t _3) {
+  clock_gettime(CLOCK_MONOTONIC, &script.start);
+  return 0;
+}
+
+static uint32_t norebo_write(uint32_t adr, uint32_t siz, uint32_t fd) {
+  mem_check_range(adr, siz, "Norebo.Write");
+  FILE *f = fd == 2 ? stderr : stdout;
+  char buf[1024];
+  uint32_t i = 0;
+  while (i < siz) {
+    size_t n = 0;
+    while (n < sizeof(buf) && i < siz) {
+      char ch = (char)mem[adr + i++];
+      buf[n++] = ch == '\r' ? '\n' : ch;
+    }
+    fwrite(buf, 1, n, f);
+  }
+  perf.bytes += siz;
+  return siz;
+}
+
+static uint32_t norebo_perf(uint32_t n, uint32_t adr, uint32_t _3) {
+  uint64_t val;
+  switch (n) {
+  case 0: {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    val = (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+    break;
+  }
+  case 1: val = cpu.insns; break;
+  case 2: val = perf.loads; break;
+  case 3: val = perf.stores; break;
+  case 4: val = cpu.branches; break;
+  case 5: val = perf.sysreqs; break;
+  case 6: val = perf.bytes; break;
+  default: return 0;
+  }
+  mem_write_word(adr, (uint32_t)val);
+  mem_write_word(adr + 4, (uint32_t)(val >> 32));
+  return 1;
+}
+
 static bool files_get_name(char *name, uint32_t adr);
 
 static uint32_t norebo_trap(uint32_t trap, uint32_t name_adr, uint32_t pos) {
@@ -126,29 +263,34 @@ static uint32_t norebo_trap(uint32_t trap, uint32_t name_adr, uint32_t pos) {
 
 /* Files module */
 
-static FILE *path_fopen(const char *path, const char *filename, const char *mode) {
+static int path_open(const char *path, const char *filename, int flags) {
   if (!path) {
     errno = ENOENT;
-    return NULL;
+    return -1;
   }
   const char *sep = strchr(path, ';') ? ";" : ":";
-  FILE *f = NULL;
+  int fd = -1;
   do {
     size_t part_len = strcspn(path, sep);
     if (part_len == 0) {
-      f = fopen(filename, mode);
+      fd = open(filename, flags);
     } else {
       char *buf = NULL;
       int r = asprintf(&buf, "%.*s/%s", (int)part_len, path, filename);
       if (r < 0) {
         err(1, NULL);
       }
-      f = fopen(buf, mode);
+      fd = open(buf, flags);
       free(buf);
     }
     path += part_len + 1;
-  } while (f == NULL && errno == ENOENT && path[-1] != 0);
-  return f;
+  } while (fd < 0 && errno == ENOENT && path[-1] != 0);
+  return fd;
+}
+
+static FILE *path_fopen(const char *path, const char *filename, const char *mode) {
+  int fd = path_open(path, filename, O_RDONLY);
+  return fd < 0 ? NULL : fdopen(fd, mode);
 }
 
 static bool files_check_name(char *name) {
@@ -171,119 +313,340 @@ static bool files_get_name(char *name, uint32_t adr) {
   return files_check_name(name);
 }
 
+static void files_init(void) {
+  for (int h = 0; h < MaxFiles; ++h) {
+    files[h].fd = -1;
+  }
+}
+
+static int files_count_open(void) {
+  int n = 0;
+  for (int h = 0; h < MaxFiles; ++h) {
+    if (files[h].fd >= 0) {
+      n++;
+    }
+  }
+  return n;
+}
+
 static int files_allocate(const char *name, bool registered) {
   for (int h = 0; h < MaxFiles; ++h) {
-    if (!files[h].f) {
+    if (files[h].fd < 0) {
+      files[h] = (struct File){ .fd = -1, .registered = registered };
       strncpy(files[h].name, name, NameLength);
-      files[h].registered = registered;
+      files[h].buf = malloc(FileBufSize);
+      if (!files[h].buf) {
+        err(1, "Files.Allocate");
+      }
       return h;
     }
   }
   errx(1, "Files.Allocate: Too many open files");
 }
 
+static void files_release(int h) {
+  free(files[h].buf);
+  files[h] = (struct File){ .fd = -1 };
+}
+
 static void files_check_handle(int h, const char *proc) {
-  if (h < 0 || h >= MaxFiles || !files[h].f) {
+  if (h < 0 || h >= MaxFiles || files[h].fd < 0) {
     errx(1, "%s: Invalid file handle", proc);
   }
 }
 
+static uint32_t files_pread(int fd, uint8_t *p, uint32_t siz, uint32_t pos, const char *name) {
+  uint32_t done = 0;
+  while (done < siz) {
+    ssize_t r = pread(fd, p + done, siz - done, (off_t)pos + done);
+    if (r < 0) {
+      err(1, "Can't read file %s", name);
+    } else if (r == 0) {
+      break;
+    }
+    done += (uint32_t)r;
+  }
+  return done;
+}
+
+static void files_pwrite(int fd, const uint8_t *p, uint32_t siz, uint32_t pos, const char *name) {
+  uint32_t done = 0;
+  while (done < siz) {
+    ssize_t r = pwrite(fd, p + done, siz - done, (off_t)pos + done);
+    if (r < 0) {
+      err(1, "Can't write file %s", name);
+    }
+    done += (uint32_t)r;
+  }
+}
+
+static void files_flush(struct File *f) {
+  if (f->dirty_lo < f->dirty_hi) {
+    files_pwrite(f->fd, f->buf + f->dirty_lo, f->dirty_hi - f->dirty_lo,
+                 f->buf_pos + f->dirty_lo, f->name);
+    f->dirty_lo = f->dirty_hi = 0;
+  }
+}
+
+static void files_flush_all(void) {
+  for (int h = 0; h < MaxFiles; ++h) {
+    if (files[h].fd >= 0) {
+      files_flush(&files[h]);
+    }
+  }
+}
+
+// Make the buffer hold the block containing pos
+static void files_load(struct File *f, uint32_t pos) {
+  uint32_t blk = pos - pos % FileBufSize;
+  if (blk != f->buf_pos || f->buf_len == 0) {
+    files_flush(f);
+    f->buf_pos = blk;
+    f->buf_len = blk < f->len ? files_pread(f->fd, f->buf, FileBufSize, blk, f->name) : 0;
+  }
+}
+
 static uint32_t files_new(uint32_t adr, uint32_t _2, uint32_t _3) {
   char name[NameLength];
   if (!files_get_name(name, adr)) {
     return -1;
   }
   int h = files_allocate(name, false);
-  files[h].f = tmpfile();
-  if (!files[h].f) {
+  const char *dir = getenv("TMPDIR");
+  char *tmpl = NULL;
+  if (asprintf(&tmpl, "%s/noreboXXXXXX", dir && dir[0] ? dir : "/tmp") < 0) {
+    err(1, NULL);
+  }
+  files[h].fd = mkstemp(tmpl);
+  if (files[h].fd < 0) {
     err(1, "Files.New: %s", name);
   }
+  unlink(tmpl);
+  free(tmpl);
+  files[h].writable = true;
   return h;
 }
 
+static bool files_same(struct File *f, struct File *g) {
+  return g != f && g->fd >= 0 && g->registered && g->dev == f->dev && g->ino == f->ino;
+}
+
+// Note which handles share a host file. Each handle keeps its own length
+// and buffer, so a write through one of them has to be passed on to the
+// others (see files_refresh_others).
+static void files_identify(struct File *f, const struct stat *st) {
+  f->dev = st->st_dev;
+  f->ino = st->st_ino;
+  f->shared = false;
+  for (int h = 0; h < MaxFiles; ++h) {
+    struct File *g = &files[h];
+    if (files_same(f, g)) {
+      f->shared = g->shared = true;
+    }
+  }
+}
+
+// After f has written to its host file, or has been registered over it,
+// other handles on that file must not keep serving its old length and
+// contents. Shared handles are written through, so the others hold no
+// pending writes, except for stale ones to a file replaced by Register.
+static void files_refresh_others(struct File *f) {
+  files_flush(f);
+  for (int h = 0; h < MaxFiles; ++h) {
+    struct File *g = &files[h];
+    if (files_same(f, g)) {
+      g->len = f->len;
+      g->buf_len = 0;
+      g->dirty_lo = g->dirty_hi = 0;
+      g->date_valid = false;
+    }
+  }
+}
+
 static uint32_t files_old(uint32_t adr, uint32_t _2, uint32_t _3) {
   char name[NameLength];
   if (!files_get_name(name, adr)) {
     return -1;
   }
   int h = files_allocate(name, true);
-  files[h].f = fopen(name, "r+b");
-  if (!files[h].f) {
-    files[h].f = path_fopen(getenv(PathEnv), name, "rb");
+  int fd = open(name, O_RDWR);
+  files[h].writable = fd >= 0;
+  if (fd < 0) {
+    fd = path_open(getenv(PathEnv), name, O_RDONLY);
   }
-  if (!files[h].f) {
-    files[h] = (struct File){0};
+  if (fd < 0) {
+    files_release(h);
     return -1;
   }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    err(1, "Files.Old: %s", name);
+  }
+  files[h].fd = fd;
+  files[h].len = (uint32_t)st.st_size;
+  files_identify(&files[h], &st);
+  if (files[h].shared) {
+    // Take over what the other handles have written but not flushed yet.
+    for (int g = 0; g < MaxFiles; ++g) {
+      if (files_same(&files[h], &files[g])) {
+        files_flush(&files[g]);
+        files[h].len = files[g].len;
+      }
+    }
+  }
   return h;
 }
 
 static uint32_t files_register(uint32_t h, uint32_t _2, uint32_t _3) {
   files_check_handle(h, "Files.Register");
-  if (!files[h].registered && files[h].name[0]) {
-    FILE *old = files[h].f;
-    files[h].f = fopen(files[h].name, "w+b");
-    if (!files[h].f) {
-      err(1, "Can't create file %s", files[h].name);
-    }
-    errno = 0;
-    fseek(old, 0, SEEK_SET);
-    char buf[8192];
-    size_t in = fread(buf, 1, sizeof(buf), old);
-    while (in != 0) {
-      size_t out = fwrite(buf, 1, in, files[h].f);
-      if (in != out) {
-        err(1, "Can't write file %s", files[h].name);
+  struct File *f = &files[h];
+  if (!f->registered && f->name[0]) {
+    files_flush(f);
+    int fd = open(f->name, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+      err(1, "Can't create file %s", f->name);
+    }
+    uint8_t buf[8192];
+    uint32_t pos = 0;
+    while (pos < f->len) {
+      uint32_t n = files_pread(f->fd, buf, sizeof(buf), pos, f->name);
+      if (n == 0) {
+        break;
       }
-      in = fread(buf, 1, sizeof(buf), old);
+      files_pwrite(fd, buf, n, pos, f->name);
+      pos += n;
     }
-    fclose(old);
-    if (fflush(files[h].f) != 0) {
-      err(1, "Can't flush file %s", files[h].name);
+    close(f->fd);
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+      err(1, "Files.Register: %s", f->name);
+    }
+    f->fd = fd;
+    f->registered = true;
+    f->date_valid = false;
+    files_identify(f, &st);
+    if (f->shared) {
+      files_refresh_others(f);
     }
-    files[h].registered = true;
   }
   return 0;
 }
 
 static uint32_t files_close(uint32_t h, uint32_t _2, uint32_t _3) {
   files_check_handle(h, "Files.Close");
-  fclose(files[h].f);
-  files[h] = (struct File){0};
+  files_flush(&files[h]);
+  close(files[h].fd);
+  files_release(h);
   return 0;
 }
 
 static uint32_t files_seek(uint32_t h, uint32_t pos, uint32_t whence) {
   files_check_handle(h, "Files.Seek");
-  return fseek(files[h].f, pos, whence);
+  struct File *f = &files[h];
+  switch (whence) {
+    case SEEK_SET: f->pos = pos; break;
+    case SEEK_CUR: f->pos += pos; break;
+    case SEEK_END: f->pos = f->len + pos; break;
+    default: return -1;
+  }
+  return 0;
 }
 
 static uint32_t files_tell(uint32_t h, uint32_t _2, uint32_t _3) {
   files_check_handle(h, "Files.Tell");
-  return (uint32_t)ftell(files[h].f);
+  return files[h].pos;
 }
 
 static uint32_t files_read(uint32_t h, uint32_t adr, uint32_t siz) {
   files_check_handle(h, "Files.Read");
   mem_check_range(adr, siz, "Files.Read");
-  size_t r = fread(mem + adr, 1, siz, files[h].f);
-  memset(mem + adr + r, 0, siz - r);
-  return (uint32_t)r;
+  struct File *f = &files[h];
+  uint32_t n = f->pos < f->len ? f->len - f->pos : 0;
+  if (n > siz) {
+    n = siz;
+  }
+  uint32_t done = 0;
+  if (n >= FileBufSize) {
+    files_flush(f);
+    done = files_pread(f->fd, mem + adr, n, f->pos, f->name);
+  } else {
+    while (done < n) {
+      files_load(f, f->pos + done);
+      uint32_t off = f->pos + done - f->buf_pos;
+      if (off >= f->buf_len) {
+        break;
+      }
+      uint32_t k = f->buf_len - off;
+      if (k > n - done) {
+        k = n - done;
+      }
+      memcpy(mem + adr + done, f->buf + off, k);
+      done += k;
+    }
+  }
+  memset(mem + adr + done, 0, siz - done);
+  f->pos += done;
+  perf.bytes += done;
+  return done;
 }
 
 static uint32_t files_write(uint32_t h, uint32_t adr, uint32_t siz) {
   files_check_handle(h, "Files.Write");
   mem_check_range(adr, siz, "Files.Write");
-  return (uint32_t)fwrite(mem + adr, 1, siz, files[h].f);
+  struct File *f = &files[h];
+  if (!f->writable) {
+    return 0;
+  }
+  if (siz >= FileBufSize) {
+    files_flush(f);
+    files_pwrite(f->fd, mem + adr, siz, f->pos, f->name);
+    f->buf_len = 0;  // drop the buffered block, it may be stale
+  } else {
+    uint32_t done = 0;
+    while (done < siz) {
+      uint32_t pos = f->pos + done;
+      files_load(f, pos);
+      uint32_t off = pos - f->buf_pos;
+      uint32_t k = FileBufSize - off;
+      if (k > siz - done) {
+        k = siz - done;
+      }
+      if (off > f->buf_len) {
+        memset(f->buf + f->buf_len, 0, off - f->buf_len);
+      }
+      memcpy(f->buf + off, mem + adr + done, k);
+      if (f->dirty_lo == f->dirty_hi) {
+        f->dirty_lo = off;
+        f->dirty_hi = off + k;
+      } else {
+        if (off < f->dirty_lo) {
+          f->dirty_lo = off;
+        }
+        if (off + k > f->dirty_hi) {
+          f->dirty_hi = off + k;
+        }
+      }
+      if (off + k > f->buf_len) {
+        f->buf_len = off + k;
+      }
+      done += k;
+    }
+  }
+  f->pos += siz;
+  if (f->pos > f->len) {
+    f->len = f->pos;
+  }
+  f->date_valid = false;
+  if (f->shared) {
+    files_refresh_others(f);
+  }
+  perf.bytes += siz;
+  return siz;
 }
 
 static uint32_t files_length(uint32_t h, uint32_t _2, uint32_t _3) {
   files_check_handle(h, "Files.Length");
-  fflush(files[h].f);
-  struct stat s;
-  int r = fstat(fileno(files[h].f), &s);
-  if (r < 0) { err(1, "Files.Length"); }
-  return (uint32_t)s.st_size;
+  return files[h].len;
 }
 
 static uint32_t time_to_oberon(time_t t) {
@@ -299,15 +662,44 @@ static uint32_t time_to_oberon(time_t t) {
 
 static uint32_t files_date(uint32_t h, uint32_t _2, uint32_t _3) {
   files_check_handle(h, "Files.Date");
-  fflush(files[h].f);
-  if (files[h].registered) {
+  struct File *f = &files[h];
+  if (!f->registered) {
+    return time_to_oberon(time(NULL));
+  }
+  if (!f->date_valid) {
+    files_flush(f);
     struct stat s;
-    int r = fstat(fileno(files[h].f), &s);
+    int r = fstat(f->fd, &s);
     if (r < 0) { err(1, "Files.Date"); }
-    return time_to_oberon(s.st_mtime);
-  } else {
-    return time_to_oberon(time(NULL));
+    f->date = time_to_oberon(s.st_mtime);
+    f->date_valid = true;
   }
+  return f->date;
+}
+
+// Length and date of a file, found like Files.Old finds it, without
+// setting up a handle. Used to check many files at once.
+static uint32_t files_stat(uint32_t adr, uint32_t res_adr, uint32_t _3) {
+  char name[NameLength];
+  mem_check_range(res_adr, 8, "Files.Stat");
+  if (!files_get_name(name, adr) || !name[0]) {
+    return -1;
+  }
+  int fd = open(name, O_RDONLY);
+  if (fd < 0) {
+    fd = path_open(getenv(PathEnv), name, O_RDONLY);
+  }
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    err(1, "Files.Stat: %s", name);
+  }
+  close(fd);
+  mem_write_word(res_adr, (uint32_t)st.st_size);
+  mem_write_word(res_adr + 4, time_to_oberon(st.st_mtime));
+  return 0;
 }
 
 static uint32_t files_delete(uint32_t adr, uint32_t _2, uint32_t _3) {
@@ -339,51 +731,536 @@ static uint32_t files_rename(uint32_t adr_old, uint32_t adr_new, uint32_t _3) {
 
 /* FileDir module */
 
-static uint32_t filedir_enumerate_begin(uint32_t _1, uint32_t _2, uint32_t _3) {
-  if (dir) {
-    closedir(dir);
+enum { EnumSearchPath = 1, EnumInfo = 2 };
+
+static void filedir_scan(const char *path, size_t path_len, const char *prefix, uint32_t flags) {
+  char *dirname = NULL;
+  if (asprintf(&dirname, "%.*s", (int)path_len, path) < 0) {
+    err(1, NULL);
   }
-  dir = opendir(".");
+  DIR *dir = opendir(path_len ? dirname : ".");
   if (!dir) {
-    err(1, "FileDir.BeginEnumerate");
+    if (path_len == 0) {
+      err(1, "FileDir.Enumerate");
+    }
+    free(dirname);
+    return;  // a missing library directory is not an error
   }
-  return 0;
+  size_t prefix_len = strlen(prefix);
+  struct dirent *ent;
+  while ((ent = readdir(dir)) != NULL) {
+    if (strncmp(ent->d_name, prefix, prefix_len) != 0 || !files_check_name(ent->d_name)) {
+      continue;
+    }
+    if (dir_count == dir_cap) {
+      dir_cap = dir_cap ? dir_cap * 2 : 256;
+      dir_entries = realloc(dir_entries, dir_cap * sizeof(dir_entries[0]));
+      if (!dir_entries) {
+        err(1, "FileDir.Enumerate");
+      }
+    }
+    struct DirEntry *e = &dir_entries[dir_count];
+    *e = (struct DirEntry){ .order = dir_count };
+    strcpy(e->name, ent->d_name);
+    if (flags & EnumInfo) {
+      char *fn = NULL;
+      struct stat st;
+      if (asprintf(&fn, "%s/%s", path_len ? dirname : ".", ent->d_name) < 0) {
+        err(1, NULL);
+      }
+      if (stat(fn, &st) == 0) {
+        e->size = (uint32_t)st.st_size;
+        e->date = time_to_oberon(st.st_mtime);
+      }
+      free(fn);
+    }
+    dir_count++;
+  }
+  closedir(dir);
+  free(dirname);
+}
+
+static int compare_entries(const void *a, const void *b) {
+  const struct DirEntry *x = a, *y = b;
+  int r = strcmp(x->name, y->name);
+  return r ? r : (x->order > y->order) - (x->order < y->order);
+}
+
+static uint32_t filedir_enumerate_begin(uint32_t prefix_adr, uint32_t flags, uint32_t _3) {
+  char prefix[NameLength] = {0};
+  if (prefix_adr) {
+    mem_check_range(prefix_adr, NameLength, "FileDir.Enumerate");
+    memcpy(prefix, mem + prefix_adr, NameLength - 1);
+  }
+  dir_count = dir_next = 0;
+  filedir_scan(".", 0, prefix, flags);
+  const char *path = getenv(PathEnv);
+  if ((flags & EnumSearchPath) && path) {
+    const char *sep = strchr(path, ';') ? ";" : ":";
+    for (;;) {
+      size_t part_len = strcspn(path, sep);
+      if (part_len != 0) {
+        filedir_scan(path, part_len, prefix, flags);
+      }
+      if (path[part_len] == 0) {
+        break;
+      }
+      path += part_len + 1;
+    }
+  }
+  // Sort by name; of several files with the same name, keep the one found first
+  qsort(dir_entries, dir_count, sizeof(dir_entries[0]), compare_entries);
+  uint32_t j = 0;
+  for (uint32_t i = 0; i < dir_count; ++i) {
+    if (j == 0 || strcmp(dir_entries[j - 1].name, dir_entries[i].name) != 0) {
+      dir_entries[j++] = dir_entries[i];
+    }
+  }
+  dir_count = j;
+  return dir_count;
 }
 
 static uint32_t filedir_enumerate_next(uint32_t adr, uint32_t _2, uint32_t _3) {
   mem_check_range(adr, NameLength, "FileDir.EnumerateNext");
-  struct dirent *ent = NULL;
-  if (dir) {
-    do {
-      ent = readdir(dir);
-    } while (ent && !files_check_name(ent->d_name));
-  }
-  if (!ent) {
+  if (dir_next == dir_count) {
     mem_write_byte(adr, 0);
     return -1;
   }
-  assert(strlen(ent->d_name) < NameLength);
-  strncpy((char *)mem + adr, ent->d_name, NameLength);
+  memcpy(mem + adr, dir_entries[dir_next++].name, NameLength);
   return 0;
 }
 
+static uint32_t filedir_enumerate_read(uint32_t adr, uint32_t max, uint32_t _3) {
+  // Entries are copied as {name: ARRAY 32 OF CHAR; size, date: INTEGER}
+  const uint32_t entry_size = NameLength + 8;
+  if (max > MemBytes / entry_size) {
+    max = MemBytes / entry_size;
+  }
+  mem_check_range(adr, max * entry_size, "FileDir.EnumerateRead");
+  uint32_t n = 0;
+  while (n < max && dir_next < dir_count) {
+    const struct DirEntry *e = &dir_entries[dir_next++];
+    memcpy(mem + adr, e->name, NameLength);
+    mem_write_word(adr + NameLength, e->size);
+    mem_write_word(adr + NameLength + 4, e->date);
+    adr += entry_size;
+    ++n;
+  }
+  return n;
+}
+
 static uint32_t filedir_enumerate_end(uint32_t _1, uint32_t _2, uint32_t _3) {
-  if (dir) {
-    closedir(dir);
-    dir = NULL;
+  dir_count = dir_next = 0;
+  return 0;
+}
+
+/* Kernel module */
+
+enum GCMode { GCNative, GCEmulated, GCCheck };
+
+struct GC {
+  enum GCMode mode;
+  uint8_t *shadow;  // check mode: memory as left by the native collector
+  uint32_t *queue;  // Kernel.Mark: blocks reached but not yet traced
+  size_t queue_len, queue_cap;
+  bool pending;
+  uint32_t org, lim, freed;
+};
+
+static struct GC gc;
+
+static uint32_t gc_get(uint8_t *m, uint32_t adr) {
+  if (adr >= MemBytes - 3) {
+    errx(1, "Kernel.GC: Memory read out of bounds (address %#08x)", adr);
+  }
+  return le32_to_host(m + adr);
+}
+
+static void gc_put(uint8_t *m, uint32_t adr, uint32_t val) {
+  if (adr >= MemBytes - 3) {
+    errx(1, "Kernel.GC: Memory write out of bounds (address %#08x)", adr);
+  }
+  m[adr] = (uint8_t)val;
+  m[adr + 1] = (uint8_t)(val >> 8);
+  m[adr + 2] = (uint8_t)(val >> 16);
+  m[adr + 3] = (uint8_t)(val >> 24);
+}
+
+// Kernel.Mark: trace the blocks reachable from the pointers at pref. Mark0
+// uses pointer reversal, which writes every pointer twice and has to wait
+// for each block before it can go on. Here a work list holds the blocks
+// still to be traced. A block is queued before its header has been read;
+// the header is prefetched and only tested when its turn comes. Either way
+// a marked block ends up with its mark word pointing at the -1 after its
+// pointer offsets.
+static void gc_queue(uint8_t *m, uint32_t p) {
+  if (gc.queue_len == gc.queue_cap) {
+    gc.queue_cap = gc.queue_cap ? gc.queue_cap * 2 : 4096;
+    gc.queue = realloc(gc.queue, gc.queue_cap * sizeof(uint32_t));
+    if (!gc.queue) {
+      err(1, "Kernel.Mark");
+    }
+  }
+  if (p < MemBytes) {
+    __builtin_prefetch(m + p - 8);
+  }
+  gc.queue[gc.queue_len++] = p;
+}
+
+static void gc_mark(uint8_t *m, uint32_t pref, int32_t heap_org) {
+  uint32_t pvadr = gc_get(m, pref);
+  while (pvadr != 0) {
+    int32_t p = (int32_t)gc_get(m, pvadr);
+    if (p >= heap_org) {
+      gc_queue(m, p);
+    }
+    pref += 4;
+    pvadr = gc_get(m, pref);
+  }
+  for (size_t i = 0; i < gc.queue_len; ++i) {
+    int32_t p = (int32_t)gc.queue[i];
+    if (gc_get(m, p - 4) == 0) {
+      uint32_t offadr = gc_get(m, p - 8) + 16, offset;
+      while ((offset = gc_get(m, offadr)) != (uint32_t)-1) {
+        int32_t r = (int32_t)gc_get(m, p + offset);
+        if (r >= heap_org) {
+          gc_queue(m, r);
+        }
+        offadr += 4;
+      }
+      gc_put(m, p - 4, offadr);
+    }
+  }
+  gc.queue_len = 0;
+}
+
+static void gc_free(uint8_t *m, uint32_t *list, int32_t q, int32_t size) {
+  gc_put(m, q, size);
+  gc_put(m, q + 4, -1);
+  gc_put(m, q + 8, *list);
+  *list = q;
+}
+
+// Kernel.Scan: sweep the heap, collecting runs of unmarked blocks into the
+// free lists of 256*n, 128, 64 and 32 byte blocks. Returns the bytes freed.
+static uint32_t gc_scan(uint8_t *m, uint32_t lists, int32_t heap_org, int32_t heap_lim) {
+  uint32_t list[4];
+  for (int i = 0; i < 4; ++i) {
+    list[i] = gc_get(m, lists + i * 4);
+  }
+  uint32_t freed = 0;
+  int32_t p = heap_org;
+  do {
+    int32_t mark = (int32_t)gc_get(m, p + 4), size;
+    int32_t q = p;
+    while (mark == 0) {
+      size = (int32_t)gc_get(m, gc_get(m, p));
+      if (size <= 0) {
+        errx(1, "Kernel.Scan: Corrupt heap (address %#08x)", p);
+      }
+      p += size;
+      mark = (int32_t)gc_get(m, p + 4);
+    }
+    size = p - q;
+    freed += size;
+    if (size > 0) {
+      if (size % 64 != 0) {
+        gc_free(m, &list[3], q, 32); q += 32; size -= 32;
+      }
+      if (size % 128 != 0) {
+        gc_free(m, &list[2], q, 64); q += 64; size -= 64;
+      }
+      if (size % 256 != 0) {
+        gc_free(m, &list[1], q, 128); q += 128; size -= 128;
+      }
+      if (size > 0) {
+        gc_free(m, &list[0], q, size);
+      }
+    }
+    if (mark > 0) {
+      size = (int32_t)gc_get(m, gc_get(m, p));
+      gc_put(m, p + 4, 0);
+    } else {  // free
+      size = (int32_t)gc_get(m, p);
+    }
+    if (size <= 0) {
+      errx(1, "Kernel.Scan: Corrupt heap (address %#08x)", p);
+    }
+    p += size;
+  } while (p < heap_lim);
+  for (int i = 0; i < 4; ++i) {
+    gc_put(m, lists + i * 4, list[i]);
+  }
+  return freed;
+}
+
+static uint8_t *gc_prepare_check(uint32_t org, uint32_t lim) {
+  if (!gc.shadow) {
+    gc.shadow = malloc(MemBytes);
+    if (!gc.shadow) {
+      err(1, "Kernel.GC");
+    }
+  }
+  memcpy(gc.shadow, mem, MemBytes);
+  gc.pending = true;
+  gc.org = org;
+  gc.lim = lim;
+  return gc.shadow;
+}
+
+// Returns 1 if the marking was done, 0 if Kernel has to do it
+static uint32_t kernel_mark(uint32_t pref, uint32_t heap_org, uint32_t _3) {
+  switch (gc.mode) {
+    case GCNative:
+      gc_mark(mem, pref, heap_org);
+      return 1;
+    case GCCheck:
+      gc_mark(gc_prepare_check(heap_org, MemBytes), pref, heap_org);
+      return 0;
+    default:
+      return 0;
+  }
+}
+
+// Returns the number of bytes freed, or -1 if Kernel has to do the sweep
+static uint32_t kernel_scan(uint32_t lists, uint32_t heap_org, uint32_t heap_lim) {
+  if (heap_org >= heap_lim || heap_lim > MemBytes) {
+    errx(1, "Kernel.Scan: Invalid heap bounds");
+  }
+  switch (gc.mode) {
+    case GCNative:
+      return gc_scan(mem, lists, heap_org, heap_lim);
+    case GCCheck:
+      gc.freed = gc_scan(gc_prepare_check(heap_org, heap_lim), lists, heap_org, heap_lim);
+      return -1;
+    default:
+      return -1;
+  }
+}
+
+// After Kernel did the work itself: compare with the native result
+static uint32_t kernel_check(uint32_t lists, uint32_t freed, uint32_t _3) {
+  if (!gc.pending) {
+    return 0;
+  }
+  gc.pending = false;
+  for (uint32_t adr = gc.org; adr < gc.lim; adr += 4) {
+    if (memcmp(mem + adr, gc.shadow + adr, 4) != 0) {
+      errx(1, "Kernel.%s: Native and emulated heap differ at %#08x",
+           lists ? "Scan" : "Mark", adr);
+    }
+  }
+  if (lists && (memcmp(mem + lists, gc.shadow + lists, 16) != 0 || freed != gc.freed)) {
+    errx(1, "Kernel.Scan: Native and emulated free lists differ");
   }
   return 0;
 }
 
+static void gc_init(void) {
+  const char *mode = getenv(GCEnv);
+  if (!mode || !mode[0] || strcmp(mode, "native") == 0) {
+    gc.mode = GCNative;
+  } else if (strcmp(mode, "emulated") == 0) {
+    gc.mode = GCEmulated;
+  } else if (strcmp(mode, "check") == 0) {
+    gc.mode = GCCheck;
+  } else {
+    errx(1, "%s must be native, emulated or check", GCEnv);
+  }
+}
+
 /* I/O dispatch */
 
 typedef uint32_t (* sysreq_fn)(uint32_t, uint32_t, uint32_t);
 
+/* Plugins */
+
+struct Plugin {
+  char name[NameLength];
+  sysreq_fn fn;
+};
+
+static struct Plugin plugins[MaxPlugins];
+static uint32_t nplugins;
+
+static uint8_t *plugin_mem(uint32_t adr, uint32_t siz, const char *proc) {
+  mem_check_range(adr, siz, proc);
+  return mem + adr;
+}
+
+static uint32_t plugin_register(const char *name, norebo_sysreq_fn fn) {
+  if (strlen(name) >= NameLength || nplugins == MaxPlugins) {
+    return 0;
+  }
+  char buf[NameLength] = {0};
+  strcpy(buf, name);
+  if (!buf[0] || !files_check_name(buf)) {
+    return 0;
+  }
+  for (uint32_t i = 0; i < nplugins; ++i) {
+    if (strcmp(plugins[i].name, buf) == 0) {
+      return 0;
+    }
+  }
+  strcpy(plugins[nplugins].name, buf);
+  plugins[nplugins].fn = fn;
+  return PluginBase + nplugins++;
+}
+
+static bool native_register(const struct norebo_native *native);
+
+static const struct norebo_host plugin_host = {
+  .abi = NOREBO_PLUGIN_ABI,
+  .mem = plugin_mem,
+  .register_sysreq = plugin_register,
+  .register_native = native_register,
+  .execute = risc_execute,
+};
+
+static int compare_names(const void *a, const void *b) {
+  return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static void load_plugins(void) {
+  const char *path = getenv(PluginEnv);
+  if (!path || !path[0]) {
+    return;
+  }
+  DIR *d = opendir(path);
+  if (!d) {
+    err(1, "%s", path);
+  }
+  char *names[MaxPlugins];
+  int n = 0;
+  struct dirent *ent;
+  while ((ent = readdir(d)) != NULL) {
+    size_t len = strlen(ent->d_name);
+    if (len > 3 && strcmp(ent->d_name + len - 3, ".so") == 0) {
+      if (n == MaxPlugins) {
+        errx(1, "Too many plugins in %s", path);
+      }
+      if (asprintf(&names[n++], "%s/%s", path, ent->d_name) < 0) {
+        err(1, "asprintf");
+      }
+    }
+  }
+  closedir(d);
+  qsort(names, n, sizeof(names[0]), compare_names);
+
+  for (int i = 0; i < n; ++i) {
+    void *so = dlopen(names[i], RTLD_NOW | RTLD_LOCAL);
+    if (!so) {
+      errx(1, "%s", dlerror());
+    }
+    int (*init)(const struct norebo_host *);
+    *(void **)&init = dlsym(so, "norebo_plugin_init");
+    if (!init) {
+      errx(1, "%s: no norebo_plugin_init", names[i]);
+    }
+    if (init(&plugin_host) != 0) {
+      errx(1, "%s: initialization failed", names[i]);
+    }
+    free(names[i]);
+  }
+}
+
+/* Native modules */
+
+struct Region {
+  const struct norebo_native *native;
+  uint32_t org, end;  // word addresses
+};
+
+static const struct norebo_native *natives[MaxNatives];
+static uint32_t nnatives;
+static struct Region regions[MaxNatives];
+static uint32_t nregions;
+
+static bool native_register(const struct norebo_native *native) {
+  if (nnatives == MaxNatives) {
+    return false;
+  }
+  natives[nnatives++] = native;
+  return true;
+}
+
+static bool native_matches(const struct norebo_native *native, uint32_t code) {
+  for (uint32_t i = 0; i < native->nwords; ++i) {
+    if (!native->fixed[i] && mem_read_word(code + i * 4) != native->code[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static uint32_t norebo_loaded(uint32_t mod, uint32_t _2, uint32_t _3) {
+  mem_check_range(mod, 64, "Modules.Load");
+  uint32_t key = mem_read_word(mod + 36);
+  uint32_t code = mem_read_word(mod + 56);
+  uint32_t imp = mem_read_word(mod + 60);
+  if (code > imp || imp > MemBytes || code % 4 != 0) {
+    return 0;
+  }
+  uint32_t org = code / 4, end = imp / 4;
+
+  // The module may reuse memory of an unloaded one
+  uint32_t j = 0;
+  for (uint32_t i = 0; i < nregions; ++i) {
+    if (regions[i].end <= org || regions[i].org >= end) {
+      regions[j++] = regions[i];
+    }
+  }
+  nregions = j;
+
+  char name[NameLength];
+  memcpy(name, mem + mod, NameLength);
+  name[NameLength - 1] = 0;
+  for (uint32_t i = 0; i < nnatives; ++i) {
+    const struct norebo_native *native = natives[i];
+    if (strcmp(native->name, name) == 0 && native->key == key &&
+        native->nwords == end - org && native_matches(native, code)) {
+      regions[nregions++] = (struct Region){native, org, end};
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void cpu_enter_native(const struct RISC_IO *io, struct RISC *cpu) {
+  uint32_t i = 0;
+  while (i < nregions) {
+    if (cpu->PC - regions[i].org < regions[i].end - regions[i].org) {
+      regions[i].native->run(&plugin_host, io, cpu, regions[i].org);
+      i = 0;
+    } else {
+      ++i;
+    }
+  }
+}
+
+static uint32_t norebo_lookup(uint32_t adr, uint32_t _2, uint32_t _3) {
+  char name[NameLength];
+  if (files_get_name(name, adr)) {
+    for (uint32_t i = 0; i < nplugins; ++i) {
+      if (strcmp(plugins[i].name, name) == 0) {
+        return PluginBase + i;
+      }
+    }
+  }
+  return (uint32_t)-1;
+}
+
 static sysreq_fn sysreq_table[] = {
   [ 1] = norebo_halt,
   [ 2] = norebo_argc,
   [ 3] = norebo_argv,
   [ 4] = norebo_trap,
+  [ 5] = norebo_next,
+  [ 6] = norebo_write,
+  [ 7] = norebo_perf,
+  [ 8] = norebo_lookup,
+  [ 9] = norebo_loaded,
+  [10] = norebo_start,
 
   [11] = files_new,
   [12] = files_old,
@@ -398,15 +1275,25 @@ static sysreq_fn sysreq_table[] = {
   [21] = files_delete,
   [22] = files_purge,
   [23] = files_rename,
+  [24] = files_stat,
 
   [31] = filedir_enumerate_begin,
   [32] = filedir_enumerate_next,
   [33] = filedir_enumerate_end,
+  [34] = filedir_enumerate_read,
+
+  [41] = kernel_mark,
+  [42] = kernel_scan,
+  [43] = kernel_check,
 };
 
 static const uint32_t sysreq_cnt = sizeof(sysreq_table) / sizeof(sysreq_table[0]);
 
 static uint32_t sysreq_exec(uint32_t n) {
+  perf.sysreqs++;
+  if (n - PluginBase < nplugins) {
+    return plugins[n - PluginBase].fn(sysarg[0], sysarg[1], sysarg[2]);
+  }
   if (n >= sysreq_cnt || !sysreq_table[n]) {
     errx(1, "Unimplemented sysreq %d\n", n);
   }
@@ -485,18 +1372,22 @@ static uint32_t cpu_read_program(struct RISC *cpu, uint32_t adr) {
 }
 
 static uint32_t cpu_read_word(struct RISC *cpu, uint32_t adr) {
+  perf.loads++;
   return (int32_t)adr >= 0 ? mem_read_word(adr) : io_read_word(adr);
 }
 
 static uint32_t cpu_read_byte(struct RISC *cpu, uint32_t adr) {
+  perf.loads++;
   return (int32_t)adr >= 0 ? mem_read_byte(adr) : io_read_word(adr);
 }
 
 static void cpu_write_word(struct RISC *cpu, uint32_t adr, uint32_t val) {
+  perf.stores++;
   (int32_t)adr >= 0 ? mem_write_word(adr, val) : io_write_word(adr, val);
 }
 
 static void cpu_write_byte(struct RISC *cpu, uint32_t adr, uint32_t val) {
+  perf.stores++;
   (int32_t)adr >= 0 ? mem_write_byte(adr, val) : io_write_word(adr, val);
 }
 
@@ -546,10 +1437,49 @@ static void load_inner_core(void) {
   err(1, "Error while reading " InnerCore);
 }
 
+static void usage(void) {
+  fprintf(stderr, "usage: norebo [-g] [-f] -s SCRIPT\n"
+                  "       norebo Module.Command [ARGS...]\n");
+  exit(1);
+}
+
 int main(int argc, char *argv[]) {
-  nargc = argc - 1;
-  nargv = argv + 1;
+  int i = 1;
+  while (i < argc && argv[i][0] == '-') {
+    if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      script.name = argv[i + 1];
+      i += 2;
+    } else if (strcmp(argv[i], "-g") == 0) {
+      script.collect = true;
+      i += 1;
+    } else if (strcmp(argv[i], "-f") == 0) {
+      script.free = true;
+      i += 1;
+    } else {
+      usage();
+    }
+  }
+
+  if (script.name) {
+    if (i != argc) {
+      usage();
+    }
+    script.f = strcmp(script.name, "-") == 0 ? stdin : fopen(script.name, "r");
+    if (!script.f) {
+      err(1, "%s", script.name);
+    }
+    if (!script_next_command()) {
+      return 0;
+    }
+  } else {
+    nargc = argc - i;
+    nargv = argv + i;
+  }
 
+  files_init();
+  gc_init();
+  atexit(files_flush_all);
+  load_plugins();
   load_inner_core();
   mem_write_word(12, MemBytes);
   mem_write_word(24, StackOrg);
@@ -560,11 +1490,17 @@ int main(int argc, char *argv[]) {
     .write_word = cpu_write_word,
     .write_byte = cpu_write_byte,
   };
-  struct RISC cpu = {
-    .PC = 0,
-    .R[12] = 0x20,
-    .R[14] = StackOrg,
+  static const struct RISC_IO native_io = {
+    .read_program = cpu_read_program,
+    .read_word = cpu_read_word,
+    .read_byte = cpu_read_byte,
+    .write_word = cpu_write_word,
+    .write_byte = cpu_write_byte,
+    .enter_native = cpu_enter_native,
   };
-  risc_run(&io, &cpu);
+  cpu.PC = 0;
+  cpu.R[12] = 0x20;
+  cpu.R[14] = StackOrg;
+  risc_run(nnatives ? &native_io : &io, &cpu);
   return 0;
 }
@@ -10,7 +10,11 @@ enum {
   FAD, FSB, FML, FDV,
 };
 
-static void risc_single_step(const struct RISC_IO *risc_io, struct RISC *risc);
+// Inlined into each loop of risc_run, which matters for speed
+static inline void risc_single_step(const struct RISC_IO *risc_io, struct RISC *risc)
+  __attribute__((always_inline));
+static inline void risc_execute_ir(const struct RISC_IO *io, struct RISC *risc, uint32_t ir)
+  __attribute__((always_inline));
 static void risc_set_register(struct RISC *risc, int reg, uint32_t value);
 static uint32_t fp_add(uint32_t x, uint32_t y, bool u, bool v);
 static uint32_t fp_mul(uint32_t x, uint32_t y);
@@ -19,14 +23,30 @@ static struct idiv { uint32_t quot, rem; } idiv(uint32_t x, uint32_t y, bool sig
 
 
 void risc_run(const struct RISC_IO *io, struct RISC *risc) {
+  while (!io->enter_native) {
+    risc_single_step(io, risc);
+  }
   for (;;) {
+    uint32_t next = risc->PC + 1;
     risc_single_step(io, risc);
+    if (risc->PC != next && io->enter_native) {
+      io->enter_native(io, risc);
+    }
   }
 }
 
-static void risc_single_step(const struct RISC_IO *io, struct RISC *risc) {
+static inline void risc_single_step(const struct RISC_IO *io, struct RISC *risc) {
   uint32_t ir = io->read_program(risc, risc->PC);
   risc->PC++;
+  risc->insns++;
+  risc_execute_ir(io, risc, ir);
+}
+
+void risc_execute(const struct RISC_IO *io, struct RISC *risc, uint32_t ir) {
+  risc_execute_ir(io, risc, ir);
+}
+
+static inline void risc_execute_ir(const struct RISC_IO *io, struct RISC *risc, uint32_t ir) {
 
   const uint32_t pbit = 0x80000000;
   const uint32_t qbit = 0x40000000;
@@ -206,6 +226,7 @@ static void risc_single_step(const struct RISC_IO *io, struct RISC *risc) {
       default: abort();  // unreachable
     }
     if (t) {
+      risc->branches++;
       if ((ir & vbit) != 0) {
         risc_set_register(risc, 15, risc->PC * 4);
       }
@@ -6,6 +6,7 @@ struct RISC {
   uint32_t R[16];
   uint32_t H;
   bool     Z, N, C, V;
+  uint64_t insns, branches;  // retired instructions, taken branches
 };
 
 struct RISC_IO {
@@ -14,8 +15,13 @@ struct RISC_IO {
   uint32_t (*read_byte)(struct RISC *risc, uint32_t adr);
   void (*write_word)(struct RISC *risc, uint32_t adr, uint32_t val);
   void (*write_byte)(struct RISC *risc, uint32_t adr, uint32_t val);
+  // Optional; called after every taken branch, so the host can run
+  // native code for the target.
+  void (*enter_native)(const struct RISC_IO *io, struct RISC *risc);
 };
 
 void risc_run(const struct RISC_IO *io, struct RISC *risc);
+// Executes instruction ir; PC must already point past it.
+void risc_execute(const struct RISC_IO *io, struct RISC *risc, uint32_t ir);
 
 #endif  // RISC_CPU_H
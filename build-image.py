@@ -92,21 +92,23 @@ def build_image(sources_dir):
     def copy(src, dst):
         return '%s=>%s' % (src, dst)
 
-    install_args = ['Oberon.dsk']
-    install_args.extend(
+    install_list = [
         copy(fn, fn)
         for fn in sorted(os.listdir(sources_dir))
-        if not fn.startswith("."))
+        if not fn.startswith(".")]
 
     for fi in FILE_LIST:
         if fi['mode'] == 'source':
             smb = fi['filename'].replace('.Mod', '.smb')
             rsx = fi['filename'].replace('.Mod', '.rsx')
             rsc = fi['filename'].replace('.Mod', '.rsc')
-            install_args.append(copy(smb, smb))
-            install_args.append(copy(rsx, rsc))
+            install_list.append(copy(smb, smb))
+            install_list.append(copy(rsx, rsc))
 
-    norebo(['VDiskUtil.InstallFiles'] + install_args,
+    # Pass the file list through a manifest instead of the command line
+    with open(os.path.join(target_dir, 'Install.Manifest'), 'w') as f:
+        f.write('\n'.join(install_list) + '\n')
+    norebo(['VDiskUtil.InstallManifest', 'Oberon.dsk', 'Install.Manifest'],
            working_directory=target_dir,
            search_path=[oberon_dir, sources_dir, norebo_dir])
 
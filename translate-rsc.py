@@ -0,0 +1,301 @@
+#!/usr/bin/env python3
+"""Translate Oberon object files (.rsc) to C, as a Norebo plugin.
+
+Each module becomes a function with one switch case per instruction. The
+plugin registers the functions together with the module keys and code, so
+Norebo only uses a translation if the loaded module is identical. Words the
+loader fixes up are executed by the interpreter.
+"""
+import sys, os.path, argparse, logging, struct
+
+
+class ObjFile:
+    def __init__(self, fn):
+        with open(fn, 'rb') as f:
+            self.data = f.read()
+        self.pos = 0
+        self.name = self.string()
+        self.key = self.int()
+        self.version = self.byte()
+        self.size = self.int()
+        while self.string():  # imports
+            self.int()
+        n = self.int()  # type descriptors
+        self.pos += n
+        self.int()  # variables
+        n = self.int()  # strings
+        self.pos += n
+        n = self.int()
+        self.code = [self.word() for _ in range(n)]
+        while self.string():  # commands
+            self.int()
+        n = self.int()  # entries
+        self.pos += n * 4
+        while self.int() >= 0:  # pointer references
+            pass
+        self.fixorgP = self.int()
+        self.fixorgD = self.int()
+        self.fixorgT = self.int()
+        self.int()  # body
+        if self.byte() != ord('O'):
+            raise ValueError('%s: corrupted object file' % fn)
+
+    def byte(self):
+        b = self.data[self.pos]
+        self.pos += 1
+        return b
+
+    def int(self):
+        x, = struct.unpack_from('<i', self.data, self.pos)
+        self.pos += 4
+        return x
+
+    def word(self):
+        x, = struct.unpack_from('<I', self.data, self.pos)
+        self.pos += 4
+        return x
+
+    def string(self):
+        end = self.data.index(0, self.pos)
+        s = self.data[self.pos:end].decode('ascii')
+        self.pos = end + 1
+        return s
+
+    def fixed_words(self):
+        """Words Modules.Load changes when it links the module."""
+        fixed = set()
+        adr = self.fixorgP  # BL to imported procedures
+        while adr != 0:
+            fixed.add(adr)
+            adr -= self.code[adr] & 0xFFF
+        adr = self.fixorgD  # LDR/STR/ADD of global and imported data
+        while adr != 0:
+            inst = self.code[adr]
+            fixed.add(adr)
+            if (inst >> 20) & 0xF != 0:
+                fixed.add(adr + 1)
+            adr -= inst & 0xFFF
+        return fixed
+
+
+PBIT, QBIT, UBIT, VBIT = 0x80000000, 0x40000000, 0x20000000, 0x10000000
+MOV, LSL, ASR, ROR, AND, ANN, IOR, XOR, ADD, SUB, MUL, DIV = range(12)
+
+CONDITIONS = ['r->N', 'r->Z', 'r->C', 'r->V', '(r->C | r->Z)',
+              '(r->N ^ r->V)', '((r->N ^ r->V) | r->Z)', 'true']
+
+
+def sign_extend(x, bits):
+    sign = 1 << (bits - 1)
+    return (x ^ sign) - sign
+
+
+def branch_target(i, ir):
+    """Static target of a branch at word i, or None."""
+    if ir & (PBIT | QBIT) != PBIT | QBIT or ir & UBIT == 0:
+        return None
+    return i + 1 + sign_extend(ir & 0xFFFFFF, 24)
+
+
+def translate_register(ir):
+    a = (ir >> 24) & 0xF
+    b = (ir >> 20) & 0xF
+    op = (ir >> 16) & 0xF
+    im = ir & 0xFFFF
+    u = ir & UBIT != 0
+    if ir & QBIT == 0:
+        c = 'R[%d]' % (ir & 0xF)
+        const = None
+    else:
+        const = (0xFFFF0000 | im) if ir & VBIT else im
+        c = '0x%Xu' % const
+
+    if op == MOV:
+        if not u:
+            val = c
+        elif ir & QBIT:
+            val = '0x%Xu' % ((const << 16) & 0xFFFFFFFF)
+        elif ir & VBIT:
+            val = ('(0xD0u | (uint32_t)r->N << 31 | (uint32_t)r->Z << 30 |'
+                   ' (uint32_t)r->C << 29 | (uint32_t)r->V << 28)')
+        else:
+            val = 'r->H'
+    elif op in (LSL, ASR, ROR) and const is not None:
+        k = const & 31
+        if k == 0:
+            val = 'R[%d]' % b
+        elif op == LSL:
+            val = 'R[%d] << %d' % (b, k)
+        elif op == ASR:
+            val = '(uint32_t)((int32_t)R[%d] >> %d)' % (b, k)
+        else:
+            val = '(R[%d] >> %d | R[%d] << %d)' % (b, k, b, 32 - k)
+    elif op == LSL:
+        val = 'R[%d] << (%s & 31)' % (b, c)
+    elif op == ASR:
+        val = '(uint32_t)((int32_t)R[%d] >> (%s & 31))' % (b, c)
+    elif op == ROR:
+        val = '(R[%d] >> (%s & 31) | R[%d] << (-%s & 31))' % (b, c, b, c)
+    elif op == AND:
+        val = 'R[%d] & %s' % (b, c)
+    elif op == ANN:
+        val = 'R[%d] & ~%s' % (b, c)
+    elif op == IOR:
+        val = 'R[%d] | %s' % (b, c)
+    elif op == XOR:
+        val = 'R[%d] ^ %s' % (b, c)
+    elif op == ADD:
+        return ['{ uint32_t b_ = R[%d], c_ = %s, a_ = b_ + c_%s;' % (b, c, ' + r->C' if u else ''),
+                '  r->C = a_ < b_; r->V = ((a_ ^ c_) & (a_ ^ b_)) >> 31; SET(%d, a_); }' % a]
+    elif op == SUB:
+        return ['{ uint32_t b_ = R[%d], c_ = %s, a_ = b_ - c_%s;' % (b, c, ' - r->C' if u else ''),
+                '  r->C = a_ > b_; r->V = ((b_ ^ c_) & (a_ ^ b_)) >> 31; SET(%d, a_); }' % a]
+    elif op == MUL:
+        if u:
+            prod = '(uint64_t)R[%d] * (uint64_t)%s' % (b, c)
+        else:
+            prod = '(uint64_t)((int64_t)(int32_t)R[%d] * (int64_t)(int32_t)%s)' % (b, c)
+        return ['{ uint64_t p_ = %s;' % prod,
+                '  r->H = (uint32_t)(p_ >> 32); SET(%d, (uint32_t)p_); }' % a]
+    else:  # division and floating point
+        return ['host->execute(io, r, 0x%08Xu);' % ir]
+    return ['SET(%d, %s);' % (a, val)]
+
+
+def translate_memory(ir):
+    a = (ir >> 24) & 0xF
+    b = (ir >> 20) & 0xF
+    off = sign_extend(ir & 0xFFFFF, 20) & 0xFFFFFFFF
+    adr = 'R[%d] + 0x%Xu' % (b, off) if off else 'R[%d]' % b
+    if ir & UBIT == 0:
+        fn = 'read_byte' if ir & VBIT else 'read_word'
+        return ['SET(%d, io->%s(r, %s));' % (a, fn, adr)]
+    elif ir & VBIT:
+        return ['io->write_byte(r, %s, (uint8_t)R[%d]);' % (adr, a)]
+    else:
+        return ['io->write_word(r, %s, R[%d]);' % (adr, a)]
+
+
+def translate_branch(i, ir, n):
+    cond = (ir >> 24) & 7
+    invert = ir & 0x08000000 != 0
+    if cond == 7 and invert:
+        return []  # never taken
+    body = ['r->branches++;']
+    if ir & VBIT:
+        body.append('SET(15, (org + %d) * 4);' % (i + 1))
+    if ir & UBIT == 0:
+        body += ['r->PC = R[%d] / 4;' % (ir & 0xF), 'continue;']
+    else:
+        target = branch_target(i, ir)
+        if 0 <= target < n:
+            body.append('goto L%d;' % target)
+        else:
+            body += ['r->PC = org + %d;' % target if target >= 0 else
+                     'r->PC = org - %d;' % -target, 'continue;']
+    if cond == 7:
+        return body
+    test = CONDITIONS[cond]
+    if invert:
+        test = '!' + test
+    return ['if (%s) {' % test] + ['  ' + line for line in body] + ['}']
+
+
+def translate_module(obj, out):
+    n = len(obj.code)
+    fixed = obj.fixed_words()
+    targets = set()
+    for i, ir in enumerate(obj.code):
+        if i not in fixed:
+            t = branch_target(i, ir)
+            if t is not None and 0 <= t < n:
+                targets.add(t)
+
+    m = obj.name
+    out.write('static const uint32_t code_%s[%d] = {\n' % (m, n))
+    for i in range(0, n, 6):
+        out.write('  %s,\n' % ', '.join('0x%08Xu' % w for w in obj.code[i:i+6]))
+    out.write('};\n\n')
+    out.write('static const uint8_t fixed_%s[%d] = {\n' % (m, n))
+    for i in range(0, n, 24):
+        out.write('  %s,\n' % ', '.join('1' if j in fixed else '0' for j in range(i, min(i+24, n))))
+    out.write('};\n\n')
+
+    out.write('static void run_%s(const struct norebo_host *host, const struct RISC_IO *io,\n' % m)
+    out.write('                   struct RISC *r, uint32_t org) {\n')
+    out.write('  uint32_t *R = r->R;\n')
+    out.write('  for (;;) {\n')
+    out.write('    switch (r->PC - org) {\n')
+    for i, ir in enumerate(obj.code):
+        label = ' L%d:' % i if i in targets else ''
+        out.write('    case %d:%s\n' % (i, label))
+        lines = ['r->insns++;']
+        if i in fixed:
+            lines += ['r->PC = org + %d;' % (i + 1),
+                      'host->execute(io, r, io->read_program(r, org + %d));' % i,
+                      'if (r->PC != org + %d) continue;' % (i + 1)]
+        elif ir & PBIT == 0:
+            lines += translate_register(ir)
+        elif ir & QBIT == 0:
+            lines += translate_memory(ir)
+        else:
+            lines += translate_branch(i, ir, n)
+        for line in lines:
+            out.write('      %s\n' % line)
+        out.write('      /* fall through */\n')
+    out.write('      r->PC = org + %d;\n' % n)
+    out.write('      return;\n')
+    out.write('    default:\n')
+    out.write('      return;\n')
+    out.write('    }\n')
+    out.write('  }\n')
+    out.write('}\n\n')
+
+    out.write('static const struct norebo_native native_%s = {\n' % m)
+    out.write('  "%s", 0x%08Xu, %d, code_%s, fixed_%s, run_%s\n' % (m, obj.key & 0xFFFFFFFF, n, m, m, m))
+    out.write('};\n\n')
+
+
+def translate(objs, out):
+    out.write('/* Generated by translate-rsc.py from %s */\n\n' % ', '.join(o.name for o in objs))
+    out.write('#include "norebo-plugin.h"\n\n')
+    out.write('#define SET(a, x) do { uint32_t v_ = (x); R[a] = v_; '
+              'r->Z = v_ == 0; r->N = (int32_t)v_ < 0; } while (0)\n\n')
+    for obj in objs:
+        translate_module(obj, out)
+    out.write('int norebo_plugin_init(const struct norebo_host *host) {\n')
+    out.write('  if (host->abi < 2) {\n')
+    out.write('    return 1;\n')
+    out.write('  }\n')
+    for obj in objs:
+        out.write('  if (!host->register_native(&native_%s)) {\n' % obj.name)
+        out.write('    return 1;\n')
+        out.write('  }\n')
+    out.write('  return 0;\n')
+    out.write('}\n')
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument(
+      '-d', '--debug', dest='debug', action='store_true', help='enable debug log output'
+    )
+    parser.add_argument('-o', dest='output', required=True, help='C file to write')
+    parser.add_argument('RSC', nargs='+')
+    args = parser.parse_args()
+    log_level = logging.DEBUG if args.debug else logging.INFO
+    logging.basicConfig(format='%(levelname)s: %(message)s', level=log_level)
+    objs = []
+    for fn in args.RSC:
+        if not os.path.isfile(fn):
+            logging.error("%s: '%s': No such file", __file__, fn)
+            sys.exit(1)
+        obj = ObjFile(fn)
+        logging.debug('%s: %d words, %d fixed up', obj.name, len(obj.code), len(obj.fixed_words()))
+        objs.append(obj)
+    with open(args.output, 'w') as out:
+        translate(objs, out)
+
+
+if __name__ == '__main__':
+    main()